@@ -4,6 +4,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef JMUC_HAS_SHA1_CACHE
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
 
 void test(char* str, char* expected) {
     uint8_t sha1[20];
@@ -30,6 +37,158 @@ void test(char* str, char* expected) {
     }
 }
 
+void test_pow_mod_batch() {
+    // compare against jmuc_bigint_pow_mod, mixing sizes and an even modulus.
+    // The last 11 jobs are 384 bits: a full group of 8 lanes and a partial one
+    enum { JOBS = 31 };
+    jmuc_bigint base[JOBS], expo[JOBS], mod[JOBS], expected[JOBS], result[JOBS];
+    jmuc_bigint_pow_mod_job jobs[JOBS];
+    uint32_t seed = 12345;
+
+    for (int i = 0; i < JOBS; i++) {
+        jmuc_bigint *nums[3] = { &base[i], &expo[i], &mod[i] };
+        for (int k = 0; k < 3; k++) {
+            *nums[k] = jmuc_bigint_new();
+            for (int j = 0; j < (i < 20 ? 4 + i % 3 * 6 : 48); j++) {
+                seed = seed * 1103515245 + 12345;
+                jmuc_bigint_push_byte(nums[k], seed >> 16);
+            }
+        }
+        mod[i].data[mod[i].size - 1] |= 0x80;
+        mod[i].data[0] |= (i == 7) ? 0 : 1;
+        expected[i] = jmuc_bigint_new();
+        result[i] = jmuc_bigint_new();
+        jmuc_bigint_pow_mod(&base[i], &expo[i], &mod[i], &expected[i]);
+
+        jobs[i].base = &base[i];
+        jobs[i].exp = &expo[i];
+        jobs[i].mod = &mod[i];
+        jobs[i].result = &result[i];
+    }
+
+    jmuc_bigint_pow_mod_batch(jobs, JOBS);
+
+    for (int i = 0; i < JOBS; i++) {
+        if (jmuc_bigint_compare(&expected[i], &result[i]) != 0) {
+            printf("Invalid pow_mod batch case: %d\n", i);
+        }
+        jmuc_bigint_free(&base[i]);
+        jmuc_bigint_free(&expo[i]);
+        jmuc_bigint_free(&mod[i]);
+        jmuc_bigint_free(&expected[i]);
+        jmuc_bigint_free(&result[i]);
+    }
+}
+
+#ifdef JMUC_HAS_SHA1_CACHE
+void test_file_cached_set_mtime(char *path, time_t mtime) {
+    // an old mtime, newer files aren't cached
+    struct utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    utime(path, &times);
+}
+
+void test_file_cached_write(char *path, char *str, time_t mtime) {
+    FILE *f = fopen(path, "wb");
+    fputs(str, f);
+    fclose(f);
+    test_file_cached_set_mtime(path, mtime);
+}
+
+int test_file_cached_is_hit(jmuc_sha1_cache *cache, char *path) {
+    struct stat st;
+    uint64_t key[4];
+    uint64_t digest[3];
+    stat(path, &st);
+    jmuc_sha1_cache_key(&st, key);
+    return jmuc_sha1_cache_lookup(cache->map, key, digest);
+}
+
+void test_file_cached_check(jmuc_sha1_cache *cache, char *path, char *str, uint8_t expected[20], int cached) {
+    uint8_t sha1[20];
+
+    if (test_file_cached_is_hit(cache, path)) {
+        printf("Unexpected cache hit: %s\n", str);
+    }
+    // the first call fills the cache, the second one reads it
+    for (int i = 0; i < 2; i++) {
+        if (jmuc_sha1_file_cached(cache, path, sha1) == 0 || memcmp(expected, sha1, 20) != 0) {
+            printf("Invalid cached case: %s call: %d\n", str, i);
+        }
+    }
+    if (test_file_cached_is_hit(cache, path) != cached) {
+        printf("Invalid cache state: %s expected: %d\n", str, cached);
+    }
+}
+
+void test_file_cached_case(jmuc_sha1_cache *cache, char *path, char *str, int cached) {
+    uint8_t expected[20];
+    jmuc_sha1_compute(str, strlen(str), expected);
+    test_file_cached_check(cache, path, str, expected, cached);
+}
+
+void test_file_cached() {
+    char *path = "jmuc_sha1_cache_test.txt";
+    char *cache_path = "jmuc_sha1_cache_test.bin";
+    jmuc_sha1_cache cache;
+    jmuc_sha1_cache other;
+
+    unlink(cache_path);
+    if (jmuc_sha1_cache_open(&cache, cache_path, 0) != 0 || jmuc_sha1_cache_open(&other, cache_path, 0) != 0) {
+        printf("Can't open the cache: %s\n", cache_path);
+        return;
+    }
+
+    // a modified file must not get the old digest, even with the same size
+    test_file_cached_write(path, "abc", 1000000000);
+    test_file_cached_case(&cache, path, "abc", 1);
+    test_file_cached_write(path, "abd", 1000000001);
+    test_file_cached_case(&cache, path, "abd", 1);
+
+    // a file modified right now can't be trusted yet
+    test_file_cached_write(path, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", time(0));
+    test_file_cached_case(&cache, path, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 0);
+    test_file_cached_write(path, "abe", 1000000002);
+    test_file_cached_case(&cache, path, "abe", 1);
+
+    // the record survives the compaction, and the other handle follows it
+    if (jmuc_sha1_cache_compact(&cache, 0) != 0 || access("jmuc_sha1_cache_test.bin.compact", F_OK) == 0) {
+        printf("Can't compact the cache: %s\n", cache_path);
+    }
+    if (!test_file_cached_is_hit(&cache, path)) {
+        printf("Record lost in compaction: %s\n", path);
+    }
+    uint8_t sha1[20];
+    if (jmuc_sha1_file_cached(&other, path, sha1) == 0
+            || jmuc_sha1_cache_is_retired(other.map)
+            || !test_file_cached_is_hit(&other, path)) {
+        printf("The other handle didn't reopen the cache: %s\n", cache_path);
+    }
+    if (cache.old_maps != 0 || other.old_maps != 0) {
+        printf("Replaced mappings not released: %s\n", cache_path);
+    }
+
+    // a sparse file over 2^29 bytes: its length in bits needs more than 32 bits
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    if (lseek(fd, 0x20000000, SEEK_SET) != 0x20000000 || write(fd, "", 1) != 1) {
+        printf("Can't write the sparse file: %s\n", path);
+    }
+    close(fd);
+    test_file_cached_set_mtime(path, 1000000003);
+    uint8_t sparse_sha1[20] = {
+        0x3e, 0x1b, 0xb5, 0x36, 0xd1, 0x84, 0x94, 0xc3, 0x2e, 0x66,
+        0xef, 0x9f, 0x47, 0x9d, 0x65, 0xbb, 0xe0, 0xd8, 0x63, 0xde
+    };
+    test_file_cached_check(&cache, path, "sparse file", sparse_sha1, 1);
+
+    jmuc_sha1_cache_close(&other);
+    jmuc_sha1_cache_close(&cache);
+    unlink(cache_path);
+    unlink(path);
+}
+#endif
+
 int main() {
     test("", "da39a3ee 5e6b4b0d 3255bfef 95601890 afd80709");
     test("abc", "a9993e36 4706816a ba3e2571 7850c26c 9cd0d89d");
@@ -43,6 +202,12 @@ int main() {
     long_str[1000000] = 0;
     test(long_str, "34aa973c d4c4daa4 f61eeb2b dbad2731 6534016f");
 
+    test_pow_mod_batch();
+
+#ifdef JMUC_HAS_SHA1_CACHE
+    test_file_cached();
+#endif
+
     printf("FINISHED\n");
     return 0;
 }
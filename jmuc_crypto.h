@@ -31,6 +31,41 @@ void jmuc_sha1_finish(jmuc_sha1_t *context);
 void jmuc_sha1_get_digest_bytes(jmuc_sha1_t *context, uint8_t digest[20]);
 
 
+// Persistent digest cache: an open addressing hash table in a memory mapped
+// file, mapping (device, inode, size, mtime in ns) to the SHA-1 of the file.
+// Lookups are lock-free and several threads or processes may share the same
+// file. Compaction replaces the file: the other handles reopen it by
+// themselves. The replaced mappings are unmapped as soon as no call to
+// jmuc_sha1_file_cached on the handle is still running.
+// Available on unix, define JMUC_NO_SHA1_CACHE to leave it out.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(JMUC_NO_SHA1_CACHE)
+#define JMUC_HAS_SHA1_CACHE
+
+typedef struct {
+    char *path;
+    int fd;
+    void *map;
+    uint64_t map_size;
+    void *old_maps;
+    uint32_t busy;      // a thread is reopening or compacting the file
+    uint32_t readers;   // jmuc_sha1_file_cached calls running
+} jmuc_sha1_cache;
+
+// All of them return 0 on success and -1 on error. capacity is the number of
+// records of a new file (rounded up to a power of two), ignored if the file
+// already exists. In compact, 0 keeps the capacity unless the table is too full.
+int jmuc_sha1_cache_open(jmuc_sha1_cache *cache, const char *path, uint32_t capacity);
+void jmuc_sha1_cache_close(jmuc_sha1_cache *cache);
+int jmuc_sha1_cache_compact(jmuc_sha1_cache *cache, uint32_t capacity);
+
+// Like jmuc_sha1_compute for the content of a file. cache may be 0. Returns 0
+// if the file can't be read. Files modified less than JMUC_SHA1_CACHE_RACY_NS
+// (2 seconds) before are hashed but not cached.
+uint8_t *jmuc_sha1_file_cached(jmuc_sha1_cache *cache, const char *path, uint8_t digest[20]);
+
+#endif
+
+
 typedef struct {
     uint8_t *data;
     uint32_t size;
@@ -56,6 +91,22 @@ void jmuc_bigint_div(jmuc_bigint *n, jmuc_bigint *d, jmuc_bigint *q, jmuc_bigint
 int jmuc_bigint_is_odd(jmuc_bigint *n);
 void jmuc_bigint_pow_mod(jmuc_bigint *base_, jmuc_bigint *exp_, jmuc_bigint *mod, jmuc_bigint *r);
 
+
+// Batched pow_mod: result = base^exp (mod mod) for every job. Jobs whose
+// moduli have the same size are computed 8 at a time in lockstep using
+// Montgomery multiplication. Compile with AVX-512 IFMA (radix 2^52 limbs) or
+// AVX2 (radix 2^29 limbs) enabled to use the SIMD units; define JMUC_NO_SIMD
+// to force the portable lanes. Jobs with an even modulus fall back to
+// jmuc_bigint_pow_mod.
+typedef struct {
+    jmuc_bigint *base;
+    jmuc_bigint *exp;
+    jmuc_bigint *mod;
+    jmuc_bigint *result;
+} jmuc_bigint_pow_mod_job;
+
+void jmuc_bigint_pow_mod_batch(jmuc_bigint_pow_mod_job *jobs, uint32_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -185,11 +236,11 @@ void jmuc_sha1_finish(jmuc_sha1_t *context) {
         jmuc_sha1_feed_byte(context, 0);
     }
 
-    // only support 32 bits
-    jmuc_sha1_feed_byte(context, 0);
+    // the length in bits, up to 2^32 bytes
     jmuc_sha1_feed_byte(context, 0);
     jmuc_sha1_feed_byte(context, 0);
     jmuc_sha1_feed_byte(context, 0);
+    jmuc_sha1_feed_byte(context, (size >> 29) & 0x07);
     jmuc_sha1_feed_byte(context, (size >> 21) & 0xFF);
     jmuc_sha1_feed_byte(context, (size >> 13) & 0xFF);
     jmuc_sha1_feed_byte(context, (size >>  5)  & 0xFF);
@@ -215,6 +266,544 @@ uint8_t* jmuc_sha1_compute(const void *buffer, uint32_t len, uint8_t digest[20])
 }
 
 
+#ifdef JMUC_HAS_SHA1_CACHE
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JMUC_SHA1_CACHE_VERSION 1
+#define JMUC_SHA1_CACHE_MIN_CAPACITY 64
+#define JMUC_SHA1_CACHE_MAX_CAPACITY 0x80000000ULL
+// tries before giving up on a record that is being written, spinning when
+// reading and yielding when inserting. A writer that crashed leaves the
+// record like that until the next compaction.
+#define JMUC_SHA1_CACHE_SPINS 64
+#define JMUC_SHA1_CACHE_WAITS 1000
+
+#ifndef JMUC_SHA1_CACHE_RACY_NS
+// files modified less than this before hashing them aren't cached. With
+// coarse timestamps a second write in the same tick keeps size and mtime.
+#define JMUC_SHA1_CACHE_RACY_NS 2000000000ULL
+#endif
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t retired;   // set when a compaction replaced the file
+    uint64_t capacity;  // records, power of two
+    uint64_t count;     // used records
+    uint8_t reserved[32];
+} jmuc_sha1_cache_header;
+
+// One cache line. seq is 0 for an empty record, odd while it's being written
+// and even otherwise: readers retry if it changed while they were reading.
+typedef struct {
+    uint64_t seq;
+    uint64_t key[4];    // device, inode, size, mtime in ns
+    uint64_t digest[3];
+} jmuc_sha1_cache_record;
+
+// a replaced mapping, kept until jmuc_sha1_cache_close because other threads
+// may still be reading it
+typedef struct jmuc_sha1_cache_old_map {
+    struct jmuc_sha1_cache_old_map *next;
+    void *map;
+    uint64_t map_size;
+} jmuc_sha1_cache_old_map;
+
+jmuc_inline static jmuc_sha1_cache_header *jmuc_sha1_cache_get_header(void *map) {
+    return (jmuc_sha1_cache_header *) map;
+}
+
+jmuc_inline static jmuc_sha1_cache_record *jmuc_sha1_cache_get_records(void *map) {
+    return (jmuc_sha1_cache_record *) ((uint8_t *) map + sizeof(jmuc_sha1_cache_header));
+}
+
+jmuc_inline static int jmuc_sha1_cache_is_retired(void *map) {
+    return __atomic_load_n(&jmuc_sha1_cache_get_header(map)->retired, __ATOMIC_ACQUIRE) != 0;
+}
+
+jmuc_inline static uint64_t jmuc_sha1_cache_hash(const uint64_t key[4]) {
+    // only device and inode: a modified file reuses its record
+    uint64_t h = key[0] * 0x9E3779B97F4A7C15ULL ^ key[1];
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+// reads a record without tearing it. Returns its seq, or 1 (odd) if it's
+// still being written after JMUC_SHA1_CACHE_SPINS tries.
+static uint64_t jmuc_sha1_cache_read(jmuc_sha1_cache_record *record, uint64_t key[4], uint64_t digest[3]) {
+    for (int spin = 0; spin < JMUC_SHA1_CACHE_SPINS; spin++) {
+        uint64_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) {
+            return 0;
+        }
+        if (seq % 2 == 1) {
+            continue;
+        }
+        for (int i = 0; i < 4; i++) {
+            key[i] = __atomic_load_n(&record->key[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < 3; i++) {
+            digest[i] = __atomic_load_n(&record->digest[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq) {
+            return seq;
+        }
+    }
+    return 1;
+}
+
+// writes a record already claimed by changing its seq to the odd value seq
+static void jmuc_sha1_cache_write(jmuc_sha1_cache_record *record, uint64_t seq, const uint64_t key[4], const uint64_t digest[3]) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < 4; i++) {
+        __atomic_store_n(&record->key[i], key[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < 3; i++) {
+        __atomic_store_n(&record->digest[i], digest[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int jmuc_sha1_cache_lookup(void *map, const uint64_t key[4], uint64_t digest[3]) {
+    jmuc_sha1_cache_header *header = jmuc_sha1_cache_get_header(map);
+    jmuc_sha1_cache_record *records = jmuc_sha1_cache_get_records(map);
+    uint64_t mask = header->capacity - 1;
+    uint64_t idx = jmuc_sha1_cache_hash(key);
+
+    for (uint64_t probe = 0; probe <= mask; probe++) {
+        uint64_t record_key[4];
+        uint64_t seq = jmuc_sha1_cache_read(records + ((idx + probe) & mask), record_key, digest);
+        if (seq == 0) {
+            return 0;
+        }
+        if (seq % 2 == 1 || record_key[0] != key[0] || record_key[1] != key[1]) {
+            continue;
+        }
+        return record_key[2] == key[2] && record_key[3] == key[3];
+    }
+    return 0;
+}
+
+// only_newer keeps a record with a later mtime for the same (device, inode)
+static int jmuc_sha1_cache_insert(void *map, const uint64_t key[4], const uint64_t digest[3], int only_newer) {
+    jmuc_sha1_cache_header *header = jmuc_sha1_cache_get_header(map);
+    jmuc_sha1_cache_record *records = jmuc_sha1_cache_get_records(map);
+    uint64_t mask = header->capacity - 1;
+    uint64_t idx = jmuc_sha1_cache_hash(key);
+
+    for (uint64_t probe = 0; probe <= mask;) {
+        jmuc_sha1_cache_record *record = records + ((idx + probe) & mask);
+        uint64_t record_key[4];
+        uint64_t record_digest[3];
+        uint64_t seq = jmuc_sha1_cache_read(record, record_key, record_digest);
+
+        // a record being written may be this same file: probing past it
+        // would store a second record for it
+        for (int wait = 0; seq % 2 == 1 && wait < JMUC_SHA1_CACHE_WAITS; wait++) {
+            sched_yield();
+            seq = jmuc_sha1_cache_read(record, record_key, record_digest);
+        }
+        if (seq % 2 == 1) {
+            return -1;
+        }
+
+        if (seq == 0) {
+            // keep the table at most 3/4 full, probing gets slow after that
+            if (__atomic_load_n(&header->count, __ATOMIC_RELAXED) * 4 >= header->capacity * 3) {
+                return -1;
+            }
+        } else if (record_key[0] != key[0] || record_key[1] != key[1]) {
+            probe++;
+            continue;
+        } else if (only_newer && record_key[3] > key[3]) {
+            return 0;
+        }
+
+        // claim it. If somebody else was faster look at the same record again
+        if (!__atomic_compare_exchange_n(&record->seq, &seq, seq + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (seq == 0) {
+            __atomic_fetch_add(&header->count, 1, __ATOMIC_RELAXED);
+        }
+        jmuc_sha1_cache_write(record, seq + 1, key, digest);
+        return 0;
+    }
+    return -1;
+}
+
+static void jmuc_sha1_cache_key(const struct stat *st, uint64_t key[4]) {
+    key[0] = st->st_dev;
+    key[1] = st->st_ino;
+    key[2] = st->st_size;
+#if defined(__APPLE__)
+    key[3] = st->st_mtimespec.tv_sec * 1000000000ULL + st->st_mtimespec.tv_nsec;
+#elif defined(__GLIBC__) && !defined(__USE_XOPEN2K8)
+    // strict modes like -std=c99 hide st_mtim
+    key[3] = st->st_mtime * 1000000000ULL + st->st_mtimensec;
+#else
+    key[3] = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static uint64_t jmuc_sha1_cache_file_size(uint64_t capacity) {
+    return sizeof(jmuc_sha1_cache_header) + capacity * sizeof(jmuc_sha1_cache_record);
+}
+
+// Returns 1 if the file was retired by a compaction before we got the lock.
+static int jmuc_sha1_cache_open_file(jmuc_sha1_cache *cache, const char *path, uint32_t capacity) {
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd < 0) {
+        return -1;
+    }
+
+    // only one process initializes a new file, and a compaction holds it
+    // until the old file is retired
+    flock(cache->fd, LOCK_EX);
+
+    struct stat st;
+    jmuc_sha1_cache_header header;
+    if (fstat(cache->fd, &st) != 0) {
+        goto error;
+    }
+    if (st.st_size == 0) {
+        if (capacity > JMUC_SHA1_CACHE_MAX_CAPACITY) {
+            goto error;
+        }
+        uint64_t slots = JMUC_SHA1_CACHE_MIN_CAPACITY;
+        while (slots < capacity) {
+            slots *= 2;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "JMUCSHA1", 8);
+        header.version = JMUC_SHA1_CACHE_VERSION;
+        header.capacity = slots;
+        // writing the last byte sizes the file, the rest stays sparse
+        uint8_t zero = 0;
+        if (lseek(cache->fd, jmuc_sha1_cache_file_size(slots) - 1, SEEK_SET) < 0
+                || write(cache->fd, &zero, 1) != 1
+                || lseek(cache->fd, 0, SEEK_SET) != 0
+                || write(cache->fd, &header, sizeof(header)) != sizeof(header)) {
+            goto error;
+        }
+    } else if (read(cache->fd, &header, sizeof(header)) != sizeof(header)) {
+        goto error;
+    }
+
+    if (header.retired) {
+        flock(cache->fd, LOCK_UN);
+        close(cache->fd);
+        cache->fd = -1;
+        return 1;
+    }
+    if (memcmp(header.magic, "JMUCSHA1", 8) != 0
+            || header.version != JMUC_SHA1_CACHE_VERSION
+            || header.capacity == 0
+            || header.capacity > JMUC_SHA1_CACHE_MAX_CAPACITY
+            || (header.capacity & (header.capacity - 1)) != 0) {
+        goto error;
+    }
+    cache->map_size = jmuc_sha1_cache_file_size(header.capacity);
+    if (fstat(cache->fd, &st) != 0 || (uint64_t) st.st_size != cache->map_size) {
+        goto error;
+    }
+
+    cache->map = mmap(0, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+        cache->map = 0;
+        goto error;
+    }
+
+    cache->path = malloc(strlen(path) + 1);
+    strcpy(cache->path, path);
+    flock(cache->fd, LOCK_UN);
+    return 0;
+
+error:
+    flock(cache->fd, LOCK_UN);
+    jmuc_sha1_cache_close(cache);
+    return -1;
+}
+
+int jmuc_sha1_cache_open(jmuc_sha1_cache *cache, const char *path, uint32_t capacity) {
+    cache->path = 0;
+    cache->map = 0;
+    cache->map_size = 0;
+    cache->old_maps = 0;
+    cache->busy = 0;
+    cache->readers = 0;
+
+    int result;
+    while ((result = jmuc_sha1_cache_open_file(cache, path, capacity)) == 1) {
+    }
+    return result;
+}
+
+static void jmuc_sha1_cache_unmap_old(jmuc_sha1_cache *cache) {
+    for (jmuc_sha1_cache_old_map *old = cache->old_maps; old != 0;) {
+        jmuc_sha1_cache_old_map *next = old->next;
+        munmap(old->map, old->map_size);
+        free(old);
+        old = next;
+    }
+    __atomic_store_n(&cache->old_maps, 0, __ATOMIC_RELAXED);
+}
+
+void jmuc_sha1_cache_close(jmuc_sha1_cache *cache) {
+    if (cache->map != 0) {
+        munmap(cache->map, cache->map_size);
+    }
+    if (cache->fd >= 0) {
+        close(cache->fd);
+    }
+    jmuc_sha1_cache_unmap_old(cache);
+    free(cache->path);
+    cache->path = 0;
+    cache->fd = -1;
+    cache->map = 0;
+    cache->map_size = 0;
+}
+
+// moves the mapping and file of fresh into cache. The current mapping stays
+// valid for the threads still using it. Needs cache->busy.
+static void jmuc_sha1_cache_replace(jmuc_sha1_cache *cache, jmuc_sha1_cache *fresh) {
+    jmuc_sha1_cache_old_map *old = malloc(sizeof(jmuc_sha1_cache_old_map));
+    old->next = cache->old_maps;
+    old->map = cache->map;
+    old->map_size = cache->map_size;
+    __atomic_store_n(&cache->old_maps, old, __ATOMIC_RELAXED);
+
+    close(cache->fd);
+    free(fresh->path);
+    cache->fd = fresh->fd;
+    cache->map_size = fresh->map_size;
+    // sequentially consistent with readers: see jmuc_sha1_cache_reclaim
+    __atomic_store_n(&cache->map, fresh->map, __ATOMIC_SEQ_CST);
+}
+
+// unmaps the replaced mappings if no jmuc_sha1_file_cached call is running.
+// The calls starting later load the current mapping, never an old one.
+// Needs cache->busy.
+static void jmuc_sha1_cache_reclaim(jmuc_sha1_cache *cache) {
+    if (__atomic_load_n(&cache->readers, __ATOMIC_SEQ_CST) == 0) {
+        jmuc_sha1_cache_unmap_old(cache);
+    }
+}
+
+// opens the file again if a compaction retired it. Needs cache->busy.
+static int jmuc_sha1_cache_reopen(jmuc_sha1_cache *cache) {
+    if (!jmuc_sha1_cache_is_retired(cache->map)) {
+        return 0;
+    }
+    jmuc_sha1_cache fresh;
+    if (jmuc_sha1_cache_open(&fresh, cache->path, 0) != 0) {
+        return -1;
+    }
+    jmuc_sha1_cache_replace(cache, &fresh);
+    return 0;
+}
+
+// the current mapping, reopening the file if needed. Returns 0 if the cache
+// can't be used right now.
+static void *jmuc_sha1_cache_get_map(jmuc_sha1_cache *cache) {
+    void *map = __atomic_load_n(&cache->map, __ATOMIC_SEQ_CST);
+    if (!jmuc_sha1_cache_is_retired(map)) {
+        return map;
+    }
+
+    // one thread reopens it, the others go without the cache meanwhile
+    uint32_t idle = 0;
+    if (!__atomic_compare_exchange_n(&cache->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    map = jmuc_sha1_cache_reopen(cache) == 0 ? cache->map : 0;
+    __atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+    return map;
+}
+
+static int jmuc_sha1_cache_compact_locked(jmuc_sha1_cache *cache, uint32_t capacity) {
+    // one compaction at a time. If another process was faster, compact its file
+    for (;;) {
+        if (jmuc_sha1_cache_reopen(cache) != 0) {
+            return -1;
+        }
+        flock(cache->fd, LOCK_EX);
+        if (!jmuc_sha1_cache_is_retired(cache->map)) {
+            break;
+        }
+        flock(cache->fd, LOCK_UN);
+    }
+
+    jmuc_sha1_cache_header *header = jmuc_sha1_cache_get_header(cache->map);
+    jmuc_sha1_cache_record *records = jmuc_sha1_cache_get_records(cache->map);
+
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < header->capacity; i++) {
+        uint64_t seq = __atomic_load_n(&records[i].seq, __ATOMIC_RELAXED);
+        count += seq != 0 && seq % 2 == 0;
+    }
+    uint64_t slots = capacity;
+    if (slots == 0) {
+        slots = header->capacity;
+        // leave room to grow: the new table starts at most half full
+        while (slots < count * 2) {
+            slots *= 2;
+        }
+    }
+    if (slots > JMUC_SHA1_CACHE_MAX_CAPACITY) {
+        flock(cache->fd, LOCK_UN);
+        return -1;
+    }
+
+    size_t path_len = strlen(cache->path);
+    char *tmp_path = malloc(path_len + sizeof(".compact"));
+    memcpy(tmp_path, cache->path, path_len);
+    memcpy(tmp_path + path_len, ".compact", sizeof(".compact"));
+    unlink(tmp_path);
+
+    jmuc_sha1_cache compacted;
+    if (jmuc_sha1_cache_open(&compacted, tmp_path, (uint32_t) slots) != 0) {
+        unlink(tmp_path);
+        free(tmp_path);
+        flock(cache->fd, LOCK_UN);
+        return -1;
+    }
+
+    // torn records are dropped, a repeated (device, inode) keeps the newest
+    int result = 0;
+    for (uint64_t i = 0; i < header->capacity && result == 0; i++) {
+        uint64_t key[4];
+        uint64_t digest[3];
+        uint64_t seq = jmuc_sha1_cache_read(records + i, key, digest);
+        if (seq != 0 && seq % 2 == 0) {
+            result = jmuc_sha1_cache_insert(compacted.map, key, digest, 1);
+        }
+    }
+
+    if (result == 0) {
+        result = msync(compacted.map, compacted.map_size, MS_SYNC);
+    }
+    if (result == 0) {
+        result = rename(tmp_path, cache->path);
+    }
+    if (result != 0) {
+        jmuc_sha1_cache_close(&compacted);
+        unlink(tmp_path);
+        free(tmp_path);
+        flock(cache->fd, LOCK_UN);
+        return -1;
+    }
+    free(tmp_path);
+
+    // retire it before releasing the lock. Unlock explicitly: a forked child
+    // may share the descriptor, so closing it would keep the lock held
+    __atomic_store_n(&header->retired, 1, __ATOMIC_RELEASE);
+    flock(cache->fd, LOCK_UN);
+    jmuc_sha1_cache_replace(cache, &compacted);
+    jmuc_sha1_cache_reclaim(cache);
+    return 0;
+}
+
+int jmuc_sha1_cache_compact(jmuc_sha1_cache *cache, uint32_t capacity) {
+    uint32_t idle = 0;
+    if (!__atomic_compare_exchange_n(&cache->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    int result = jmuc_sha1_cache_compact_locked(cache, capacity);
+    __atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+    return result;
+}
+
+static uint8_t *jmuc_sha1_file_digest(void *map, const char *path, uint8_t digest[20]) {
+    struct stat st;
+    uint64_t key[4];
+    uint64_t words[3];
+
+    if (map != 0 && stat(path, &st) == 0) {
+        jmuc_sha1_cache_key(&st, key);
+        if (jmuc_sha1_cache_lookup(map, key, words)) {
+            memcpy(digest, words, 20);
+            return digest;
+        }
+    }
+
+    uint64_t start = time(0) * 1000000000ULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    // jmuc_sha1_t keeps the length in bytes in a uint32_t
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size > 0xFFFFFFFF) {
+        close(fd);
+        return 0;
+    }
+    jmuc_sha1_cache_key(&st, key);
+
+    jmuc_sha1_t context;
+    uint8_t buffer[65536];
+    ssize_t len;
+    jmuc_sha1_initialize(&context);
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        jmuc_sha1_feed_bytes(&context, buffer, len);
+    }
+    if (len < 0) {
+        close(fd);
+        return 0;
+    }
+    jmuc_sha1_finish(&context);
+    jmuc_sha1_get_digest_bytes(&context, digest);
+
+    // don't cache it if it was modified while hashing it, or so shortly
+    // before that the timestamp can't tell
+    uint64_t key_after[4];
+    int unchanged = fstat(fd, &st) == 0;
+    jmuc_sha1_cache_key(&st, key_after);
+    unchanged = unchanged && memcmp(key, key_after, sizeof(key)) == 0;
+    unchanged = unchanged && key[3] + JMUC_SHA1_CACHE_RACY_NS <= start;
+    close(fd);
+
+    if (map != 0 && unchanged) {
+        words[2] = 0;
+        memcpy(words, digest, 20);
+        jmuc_sha1_cache_insert(map, key, words, 0);
+    }
+    return digest;
+}
+
+uint8_t *jmuc_sha1_file_cached(jmuc_sha1_cache *cache, const char *path, uint8_t digest[20]) {
+    if (cache == 0) {
+        return jmuc_sha1_file_digest(0, path, digest);
+    }
+
+    __atomic_add_fetch(&cache->readers, 1, __ATOMIC_SEQ_CST);
+    uint8_t *result = jmuc_sha1_file_digest(jmuc_sha1_cache_get_map(cache), path, digest);
+
+    // the last one out unmaps what reopens and compactions replaced
+    uint32_t idle = 0;
+    if (__atomic_sub_fetch(&cache->readers, 1, __ATOMIC_SEQ_CST) == 0
+            && __atomic_load_n(&cache->old_maps, __ATOMIC_RELAXED) != 0
+            && __atomic_compare_exchange_n(&cache->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        jmuc_sha1_cache_reclaim(cache);
+        __atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+#endif // JMUC_HAS_SHA1_CACHE
+
+
 static char to_hex(uint8_t v) {
     if (v > 0xF) {
         return '*';
@@ -587,6 +1176,420 @@ void jmuc_bigint_pow_mod(jmuc_bigint *base_, jmuc_bigint *exp_, jmuc_bigint *mod
 }
 
 
+// Lockstep Montgomery arithmetic for jmuc_bigint_pow_mod_batch.
+//
+// Every number is stored as `limbs` limbs of JMUC_MONT_RADIX bits, and every
+// limb as JMUC_MONT_LANES consecutive uint64_t, one per independent operand:
+// limb j of lane l lives at data[j * JMUC_MONT_LANES + l]. This way a limb of
+// all the lanes is a single vector load.
+
+#define JMUC_MONT_LANES 8
+#define JMUC_MONT_WINDOW 4
+
+#if !defined(JMUC_NO_SIMD) && defined(__AVX512F__) && defined(__AVX512IFMA__)
+
+#include <immintrin.h>
+
+#define JMUC_MONT_IFMA
+#define JMUC_MONT_RADIX 52
+
+typedef __m512i jmuc_lanes;
+
+jmuc_inline static jmuc_lanes jmuc_lanes_load(const uint64_t *p) { return _mm512_loadu_si512((const void *) p); }
+jmuc_inline static void jmuc_lanes_store(uint64_t *p, jmuc_lanes a) { _mm512_storeu_si512((void *) p, a); }
+jmuc_inline static jmuc_lanes jmuc_lanes_set1(uint64_t v) { return _mm512_set1_epi64((long long) v); }
+jmuc_inline static jmuc_lanes jmuc_lanes_add(jmuc_lanes a, jmuc_lanes b) { return _mm512_add_epi64(a, b); }
+jmuc_inline static jmuc_lanes jmuc_lanes_sub(jmuc_lanes a, jmuc_lanes b) { return _mm512_sub_epi64(a, b); }
+jmuc_inline static jmuc_lanes jmuc_lanes_and(jmuc_lanes a, jmuc_lanes b) { return _mm512_and_si512(a, b); }
+jmuc_inline static jmuc_lanes jmuc_lanes_andnot(jmuc_lanes a, jmuc_lanes b) { return _mm512_andnot_si512(a, b); }
+jmuc_inline static jmuc_lanes jmuc_lanes_or(jmuc_lanes a, jmuc_lanes b) { return _mm512_or_si512(a, b); }
+#define jmuc_lanes_srli(a, count) _mm512_srli_epi64((a), (count))
+
+// acc + low / high 52 bits of the 104 bits product a * b
+jmuc_inline static jmuc_lanes jmuc_lanes_madd_lo(jmuc_lanes acc, jmuc_lanes a, jmuc_lanes b) { return _mm512_madd52lo_epu64(acc, a, b); }
+jmuc_inline static jmuc_lanes jmuc_lanes_madd_hi(jmuc_lanes acc, jmuc_lanes a, jmuc_lanes b) { return _mm512_madd52hi_epu64(acc, a, b); }
+
+#elif !defined(JMUC_NO_SIMD) && defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define JMUC_MONT_RADIX 29
+
+typedef struct {
+    __m256i lo;
+    __m256i hi;
+} jmuc_lanes;
+
+jmuc_inline static jmuc_lanes jmuc_lanes_load(const uint64_t *p) {
+    jmuc_lanes r;
+    r.lo = _mm256_loadu_si256((const __m256i *) p);
+    r.hi = _mm256_loadu_si256((const __m256i *) (p + 4));
+    return r;
+}
+
+jmuc_inline static void jmuc_lanes_store(uint64_t *p, jmuc_lanes a) {
+    _mm256_storeu_si256((__m256i *) p, a.lo);
+    _mm256_storeu_si256((__m256i *) (p + 4), a.hi);
+}
+
+jmuc_inline static jmuc_lanes jmuc_lanes_set1(uint64_t v) {
+    jmuc_lanes r;
+    r.lo = _mm256_set1_epi64x((long long) v);
+    r.hi = r.lo;
+    return r;
+}
+
+#define JMUC_LANES_BINARY_OP(name, intrinsic)                               \
+    jmuc_inline static jmuc_lanes name(jmuc_lanes a, jmuc_lanes b) {        \
+        jmuc_lanes r;                                                       \
+        r.lo = intrinsic(a.lo, b.lo);                                       \
+        r.hi = intrinsic(a.hi, b.hi);                                       \
+        return r;                                                           \
+    }
+
+JMUC_LANES_BINARY_OP(jmuc_lanes_add, _mm256_add_epi64)
+JMUC_LANES_BINARY_OP(jmuc_lanes_sub, _mm256_sub_epi64)
+JMUC_LANES_BINARY_OP(jmuc_lanes_and, _mm256_and_si256)
+JMUC_LANES_BINARY_OP(jmuc_lanes_andnot, _mm256_andnot_si256)
+JMUC_LANES_BINARY_OP(jmuc_lanes_or, _mm256_or_si256)
+// 64 bits product of the low 32 bits of a and b
+JMUC_LANES_BINARY_OP(jmuc_lanes_mul, _mm256_mul_epu32)
+
+jmuc_inline static jmuc_lanes jmuc_lanes_srli_(jmuc_lanes a, int count) {
+    jmuc_lanes r;
+    r.lo = _mm256_srli_epi64(a.lo, count);
+    r.hi = _mm256_srli_epi64(a.hi, count);
+    return r;
+}
+#define jmuc_lanes_srli(a, count) jmuc_lanes_srli_((a), (count))
+
+#else
+
+#define JMUC_MONT_RADIX 29
+
+typedef struct {
+    uint64_t v[JMUC_MONT_LANES];
+} jmuc_lanes;
+
+jmuc_inline static jmuc_lanes jmuc_lanes_load(const uint64_t *p) {
+    jmuc_lanes r;
+    memcpy(r.v, p, sizeof(r.v));
+    return r;
+}
+
+jmuc_inline static void jmuc_lanes_store(uint64_t *p, jmuc_lanes a) {
+    memcpy(p, a.v, sizeof(a.v));
+}
+
+jmuc_inline static jmuc_lanes jmuc_lanes_set1(uint64_t v) {
+    jmuc_lanes r;
+    for (int l = 0; l < JMUC_MONT_LANES; l++) {
+        r.v[l] = v;
+    }
+    return r;
+}
+
+#define JMUC_LANES_BINARY_OP(name, expr)                                    \
+    jmuc_inline static jmuc_lanes name(jmuc_lanes a, jmuc_lanes b) {        \
+        jmuc_lanes r;                                                       \
+        for (int l = 0; l < JMUC_MONT_LANES; l++) {                         \
+            uint64_t x = a.v[l];                                            \
+            uint64_t y = b.v[l];                                            \
+            r.v[l] = (expr);                                                \
+        }                                                                   \
+        return r;                                                           \
+    }
+
+JMUC_LANES_BINARY_OP(jmuc_lanes_add, x + y)
+JMUC_LANES_BINARY_OP(jmuc_lanes_sub, x - y)
+JMUC_LANES_BINARY_OP(jmuc_lanes_and, x & y)
+JMUC_LANES_BINARY_OP(jmuc_lanes_andnot, ~x & y)
+JMUC_LANES_BINARY_OP(jmuc_lanes_or, x | y)
+// same as _mm256_mul_epu32: product of the low 32 bits
+JMUC_LANES_BINARY_OP(jmuc_lanes_mul, (x & 0xFFFFFFFF) * (y & 0xFFFFFFFF))
+
+jmuc_inline static jmuc_lanes jmuc_lanes_srli_(jmuc_lanes a, int count) {
+    for (int l = 0; l < JMUC_MONT_LANES; l++) {
+        a.v[l] >>= count;
+    }
+    return a;
+}
+#define jmuc_lanes_srli(a, count) jmuc_lanes_srli_((a), (count))
+
+#endif
+
+#define JMUC_MONT_MASK ((((uint64_t) 1) << JMUC_MONT_RADIX) - 1)
+
+typedef struct {
+    uint32_t limbs;
+    uint64_t *mod;      // limbs + 1 (the top one is always zero)
+    uint64_t *mod_inv;  // -mod^-1 (mod 2^JMUC_MONT_RADIX), one limb
+    uint64_t *acc;      // limbs + 1, scratch for jmuc_mont_mul
+    uint64_t *diff;     // limbs + 1, scratch for jmuc_mont_mul
+} jmuc_mont;
+
+// acc += a * b, where a has n limbs and b is a single limb
+jmuc_inline static void jmuc_mont_mul_add(uint64_t *acc, const uint64_t *a, jmuc_lanes b, uint32_t n) {
+#ifdef JMUC_MONT_IFMA
+    jmuc_lanes zero = jmuc_lanes_set1(0);
+    jmuc_lanes hi = zero;
+    for (uint32_t j = 0; j < n; j++) {
+        jmuc_lanes aj = jmuc_lanes_load(a + j * JMUC_MONT_LANES);
+        jmuc_lanes v = jmuc_lanes_add(jmuc_lanes_load(acc + j * JMUC_MONT_LANES), hi);
+        jmuc_lanes_store(acc + j * JMUC_MONT_LANES, jmuc_lanes_madd_lo(v, aj, b));
+        hi = jmuc_lanes_madd_hi(zero, aj, b);
+    }
+    uint64_t *top = acc + n * JMUC_MONT_LANES;
+    jmuc_lanes_store(top, jmuc_lanes_add(jmuc_lanes_load(top), hi));
+#else
+    // limbs are below 2^29, so the whole product fits and the carry is
+    // propagated later by jmuc_mont_mul
+    for (uint32_t j = 0; j < n; j++) {
+        jmuc_lanes aj = jmuc_lanes_load(a + j * JMUC_MONT_LANES);
+        jmuc_lanes v = jmuc_lanes_load(acc + j * JMUC_MONT_LANES);
+        jmuc_lanes_store(acc + j * JMUC_MONT_LANES, jmuc_lanes_add(v, jmuc_lanes_mul(aj, b)));
+    }
+#endif
+}
+
+// low JMUC_MONT_RADIX bits of a * b
+jmuc_inline static jmuc_lanes jmuc_mont_mul_lo(jmuc_lanes a, jmuc_lanes b) {
+#ifdef JMUC_MONT_IFMA
+    return jmuc_lanes_madd_lo(jmuc_lanes_set1(0), a, b);
+#else
+    return jmuc_lanes_and(jmuc_lanes_mul(a, b), jmuc_lanes_set1(JMUC_MONT_MASK));
+#endif
+}
+
+// t = a * b / R (mod m) for all the lanes, with R = 2^(JMUC_MONT_RADIX * limbs).
+// a and b must be below m. t may be the same as a or b.
+static void jmuc_mont_mul(jmuc_mont *ctx, uint64_t *t, const uint64_t *a, const uint64_t *b) {
+    uint32_t n = ctx->limbs;
+    uint64_t *acc = ctx->acc;
+    uint64_t *diff = ctx->diff;
+    const uint64_t *m = ctx->mod;
+    jmuc_lanes mask = jmuc_lanes_set1(JMUC_MONT_MASK);
+    jmuc_lanes mod_inv = jmuc_lanes_load(ctx->mod_inv);
+
+    memset(acc, 0, (n + 1) * JMUC_MONT_LANES * sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < n; i++) {
+        jmuc_mont_mul_add(acc, a, jmuc_lanes_load(b + i * JMUC_MONT_LANES), n);
+
+        jmuc_lanes q = jmuc_mont_mul_lo(jmuc_lanes_load(acc), mod_inv);
+        jmuc_mont_mul_add(acc, m, q, n);
+
+        // the lowest limb is a multiple of the radix now: drop it while
+        // normalizing the rest of the limbs
+        jmuc_lanes carry = jmuc_lanes_srli(jmuc_lanes_load(acc), JMUC_MONT_RADIX);
+        for (uint32_t j = 1; j <= n; j++) {
+            jmuc_lanes v = jmuc_lanes_add(jmuc_lanes_load(acc + j * JMUC_MONT_LANES), carry);
+            jmuc_lanes_store(acc + (j - 1) * JMUC_MONT_LANES, jmuc_lanes_and(v, mask));
+            carry = jmuc_lanes_srli(v, JMUC_MONT_RADIX);
+        }
+        jmuc_lanes_store(acc + n * JMUC_MONT_LANES, carry);
+    }
+
+    // acc < 2m: subtract m in the lanes where it doesn't borrow
+    jmuc_lanes borrow = jmuc_lanes_set1(0);
+    for (uint32_t j = 0; j <= n; j++) {
+        jmuc_lanes v = jmuc_lanes_load(acc + j * JMUC_MONT_LANES);
+        v = jmuc_lanes_sub(jmuc_lanes_sub(v, jmuc_lanes_load(m + j * JMUC_MONT_LANES)), borrow);
+        borrow = jmuc_lanes_srli(v, 63);
+        jmuc_lanes_store(diff + j * JMUC_MONT_LANES, jmuc_lanes_and(v, mask));
+    }
+    jmuc_lanes select = jmuc_lanes_sub(borrow, jmuc_lanes_set1(1));
+    for (uint32_t j = 0; j < n; j++) {
+        jmuc_lanes d = jmuc_lanes_and(jmuc_lanes_load(diff + j * JMUC_MONT_LANES), select);
+        jmuc_lanes v = jmuc_lanes_andnot(select, jmuc_lanes_load(acc + j * JMUC_MONT_LANES));
+        jmuc_lanes_store(t + j * JMUC_MONT_LANES, jmuc_lanes_or(d, v));
+    }
+}
+
+static uint32_t jmuc_mont_limbs(jmuc_bigint *mod) {
+    reduce_size(mod);
+    uint32_t bits = mod->size * 8;
+    if (mod->size != 0) {
+        for (uint8_t top = mod->data[mod->size - 1]; (top & 0x80) == 0; top <<= 1) {
+            bits--;
+        }
+    }
+    return (bits + JMUC_MONT_RADIX - 1) / JMUC_MONT_RADIX;
+}
+
+// stores n into the lane `lane` of dst
+static void jmuc_mont_from_bigint(uint64_t *dst, uint32_t limbs, uint32_t lane, jmuc_bigint *n) {
+    for (uint32_t j = 0; j < limbs; j++) {
+        uint32_t bit = j * JMUC_MONT_RADIX;
+        uint64_t v = 0;
+        for (uint32_t k = 0; k < 8; k++) {
+            if (bit / 8 + k < n->size) {
+                v |= ((uint64_t) n->data[bit / 8 + k]) << (8 * k);
+            }
+        }
+        dst[j * JMUC_MONT_LANES + lane] = (v >> (bit % 8)) & JMUC_MONT_MASK;
+    }
+}
+
+static void jmuc_mont_to_bigint(jmuc_bigint *n, const uint64_t *src, uint32_t limbs, uint32_t lane) {
+    uint32_t bytes = (limbs * JMUC_MONT_RADIX + 7) / 8;
+    jmuc_bigint_set_zero(n);
+    jmuc_bigint_reserve_size(n, bytes);
+    for (uint32_t i = 0; i < bytes; i++) {
+        uint32_t j = i * 8 / JMUC_MONT_RADIX;
+        uint32_t offset = i * 8 % JMUC_MONT_RADIX;
+        uint64_t v = src[j * JMUC_MONT_LANES + lane] >> offset;
+        if (offset + 8 > JMUC_MONT_RADIX && j + 1 < limbs) {
+            v |= src[(j + 1) * JMUC_MONT_LANES + lane] << (JMUC_MONT_RADIX - offset);
+        }
+        jmuc_bigint_push_byte(n, v & 0xFF);
+    }
+    reduce_size(n);
+}
+
+jmuc_inline static uint32_t jmuc_mont_exp_window(jmuc_bigint *exp, uint32_t window) {
+    // JMUC_MONT_WINDOW is 4: two windows per byte
+    if (window / 2 >= exp->size) {
+        return 0;
+    }
+    return (exp->data[window / 2] >> ((window % 2) * 4)) & 0xF;
+}
+
+// pow_mod for up to JMUC_MONT_LANES jobs whose moduli are odd and have
+// `limbs` limbs. The unused lanes repeat the first job.
+static void jmuc_bigint_pow_mod_lanes(jmuc_bigint_pow_mod_job **jobs, uint32_t count, uint32_t limbs) {
+    const uint32_t table_size = 1 << JMUC_MONT_WINDOW;
+    const uint32_t number = limbs * JMUC_MONT_LANES;
+
+    // mod + acc + diff, mod_inv, base, x, r2, one, gather and the window table
+    uint64_t *buffer = calloc((3 * (limbs + 1) + 1 + (5 + table_size) * limbs) * JMUC_MONT_LANES, sizeof(uint64_t));
+    jmuc_mont ctx;
+    ctx.limbs = limbs;
+    ctx.mod = buffer;
+    ctx.acc = ctx.mod + (limbs + 1) * JMUC_MONT_LANES;
+    ctx.diff = ctx.acc + (limbs + 1) * JMUC_MONT_LANES;
+    ctx.mod_inv = ctx.diff + (limbs + 1) * JMUC_MONT_LANES;
+    uint64_t *base = ctx.mod_inv + JMUC_MONT_LANES;
+    uint64_t *x = base + number;
+    uint64_t *r2 = x + number;
+    uint64_t *one = r2 + number;
+    uint64_t *gather = one + number;
+    uint64_t *table = gather + number;
+
+    jmuc_bigint *exps[JMUC_MONT_LANES];
+    jmuc_bigint tmp = jmuc_bigint_new();
+    jmuc_bigint tmp2 = jmuc_bigint_new();
+    jmuc_bigint power = jmuc_bigint_new();
+    uint32_t windows = 0;
+
+    for (uint32_t l = 0; l < JMUC_MONT_LANES; l++) {
+        jmuc_bigint_pow_mod_job *job = jobs[l < count ? l : 0];
+        exps[l] = job->exp;
+        reduce_size(job->exp);
+        if (job->exp->size * 2 > windows) {
+            windows = job->exp->size * 2;
+        }
+
+        jmuc_mont_from_bigint(ctx.mod, limbs, l, job->mod);
+
+        // -mod^-1: Newton iteration, every step doubles the correct bits
+        uint64_t m0 = ctx.mod[l];
+        uint64_t inv = m0;
+        for (int i = 0; i < 5; i++) {
+            inv *= 2 - m0 * inv;
+        }
+        ctx.mod_inv[l] = (0 - inv) & JMUC_MONT_MASK;
+
+        // r2 = R^2 (mod m)
+        uint32_t bit = 2 * limbs * JMUC_MONT_RADIX;
+        jmuc_bigint_set_zero(&power);
+        for (uint32_t i = 0; i < bit / 8; i++) {
+            jmuc_bigint_push_byte(&power, 0);
+        }
+        jmuc_bigint_push_byte(&power, 1 << (bit % 8));
+        jmuc_bigint_div(&power, job->mod, &tmp, &tmp2);
+        jmuc_mont_from_bigint(r2, limbs, l, &tmp2);
+
+        // base := base % modulus
+        jmuc_bigint_div(job->base, job->mod, &tmp, &tmp2);
+        jmuc_mont_from_bigint(base, limbs, l, &tmp2);
+
+        one[l] = 1;
+    }
+
+    // table[k] = base^k in Montgomery form, table[0] = R (mod m)
+    jmuc_mont_mul(&ctx, table, r2, one);
+    jmuc_mont_mul(&ctx, table + number, base, r2);
+    for (uint32_t k = 2; k < table_size; k++) {
+        jmuc_mont_mul(&ctx, table + k * number, table + (k - 1) * number, table + number);
+    }
+
+    // left to right fixed window exponentiation
+    memcpy(x, table, number * sizeof(uint64_t));
+    for (uint32_t w = windows; w--;) {
+        if (w + 1 != windows) {
+            for (uint32_t i = 0; i < JMUC_MONT_WINDOW; i++) {
+                jmuc_mont_mul(&ctx, x, x, x);
+            }
+        }
+        for (uint32_t l = 0; l < JMUC_MONT_LANES; l++) {
+            const uint64_t *entry = table + jmuc_mont_exp_window(exps[l], w) * number;
+            for (uint32_t j = 0; j < limbs; j++) {
+                gather[j * JMUC_MONT_LANES + l] = entry[j * JMUC_MONT_LANES + l];
+            }
+        }
+        jmuc_mont_mul(&ctx, x, x, gather);
+    }
+
+    // back from the Montgomery form
+    jmuc_mont_mul(&ctx, x, x, one);
+    for (uint32_t l = 0; l < count; l++) {
+        jmuc_mont_to_bigint(jobs[l]->result, x, limbs, l);
+    }
+
+    jmuc_bigint_free(&tmp);
+    jmuc_bigint_free(&tmp2);
+    jmuc_bigint_free(&power);
+    free(buffer);
+}
+
+static int jmuc_bigint_pow_mod_job_compare(const void *a, const void *b) {
+    uint64_t ka = *(const uint64_t *) a;
+    uint64_t kb = *(const uint64_t *) b;
+    return (ka > kb) - (ka < kb);
+}
+
+void jmuc_bigint_pow_mod_batch(jmuc_bigint_pow_mod_job *jobs, uint32_t count) {
+    // group the jobs by size: key = (limbs << 32) | job index
+    uint64_t *keys = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t pending = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        jmuc_bigint_pow_mod_job *job = jobs + i;
+        if (!jmuc_bigint_is_odd(job->mod)) {
+            // Montgomery needs an odd modulus
+            jmuc_bigint_pow_mod(job->base, job->exp, job->mod, job->result);
+            continue;
+        }
+        keys[pending++] = (((uint64_t) jmuc_mont_limbs(job->mod)) << 32) | i;
+    }
+    qsort(keys, pending, sizeof(uint64_t), jmuc_bigint_pow_mod_job_compare);
+
+    for (uint32_t start = 0; start < pending;) {
+        jmuc_bigint_pow_mod_job *lanes[JMUC_MONT_LANES];
+        uint32_t limbs = keys[start] >> 32;
+        uint32_t count_lanes = 0;
+        while (start < pending && count_lanes < JMUC_MONT_LANES && (keys[start] >> 32) == limbs) {
+            lanes[count_lanes++] = jobs + (uint32_t) keys[start];
+            start++;
+        }
+        jmuc_bigint_pow_mod_lanes(lanes, count_lanes, limbs);
+    }
+
+    free(keys);
+}
+
+
 #endif // JMUC_CRYPTO_IMPLEMENTATION
 
 /*